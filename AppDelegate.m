@@ -23,6 +23,7 @@
 #import <Foundation/NSSelectInputSource.h>
 #import <Foundation/NSSocket.h>
 #import "AppDelegate.h"
+#include "latency.h"
 
 @implementation AppDelegate
 - (AppDelegate *)init {
@@ -51,6 +52,20 @@
     [item setTarget:self];
     [item setSubmenu:windows];
 
+    if(lat_enabled()) {
+        NSMenu *debug = [NSMenu new];
+        item = [debug addItemWithTitle:@"Dump Latency Stats"
+            action:@selector(dumpLatencyStats:) keyEquivalent:@""];
+        [item setTarget:self];
+        item = [debug addItemWithTitle:@"Reset Latency Stats"
+            action:@selector(resetLatencyStats:) keyEquivalent:@""];
+        [item setTarget:self];
+
+        item = [mainMenu addItemWithTitle:@"Debug" action:NULL keyEquivalent:@""];
+        [item setTarget:self];
+        [item setSubmenu:debug];
+    }
+
     [NSApp setMenu:mainMenu];
     [NSApp addWindowsItem:_window title:[_window title] filename:NO];
 
@@ -78,6 +93,18 @@
     return [_view terminalSize];
 }
 
+- (void)dumpLatencyStats:(id)sender {
+    lat_dump(stderr);
+}
+
+- (void)resetLatencyStats:(id)sender {
+    lat_reset();
+}
+
+- (void)applicationWillTerminate:(NSNotification *)note {
+    [_view closeSessionLog]; // make sure everything logged reaches the disk
+}
+
 - (void)selectInputSource:(NSSelectInputSource *)inputSource selectEvent:(NSUInteger)selectEvent {
     [_view handlePTYInput];
 }
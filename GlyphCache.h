@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2024 Zoe Knox <zoe@pixin.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#import <AppKit/AppKit.h>
+#import <CoreGraphics/CoreGraphics.h>
+
+// Persistent cache of the cell metrics and pre-rasterized ASCII and
+// box-drawing glyphs for one font, size and color combination. The file is
+// mmapped at startup so we can size the window and draw the first frames
+// without loading the font or laying out any text.
+@interface GlyphCache: NSObject {
+    uint64_t _key;
+    void *_map;
+    size_t _mapLength;
+    NSSize _cellSize;
+    CGColorSpaceRef _cgColorSpace;
+    CGImageRef *_images; // created on first use, one per glyph slot
+}
+
++ (uint64_t)keyForFontName:(NSString *)name size:(float)size
+    foreground:(uint32_t)fg background:(uint32_t)bg;
+
+- (GlyphCache *)initWithKey:(uint64_t)key;
+- (BOOL)isValid;
+- (NSSize)cellSize;
+- (BOOL)rebuildWithAttributes:(NSDictionary *)attrs cellSize:(NSSize)size;
+- (CGImageRef)imageForCharacter:(wchar_t)c;
+
+@end
+
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2024 Zoe Knox <zoe@pixin.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#import "GlyphCache.h"
+
+#define CACHE_MAGIC     0x31434754 // "TGC1"
+#define CACHE_VERSION   1
+#define CACHE_FILE      @"glyphs.cache"
+
+// glyph slots: printable ASCII followed by the Unicode box-drawing block
+#define ASCII_FIRST     0x20
+#define ASCII_LAST      0x7E
+#define BOX_FIRST       0x2500
+#define BOX_LAST        0x257F
+#define NASCII          (ASCII_LAST - ASCII_FIRST + 1)
+#define NGLYPHS         (NASCII + (BOX_LAST - BOX_FIRST + 1))
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    double cellWidth;
+    double cellHeight;
+    uint32_t pixelWidth;
+    uint32_t pixelHeight;
+    uint32_t nglyphs;
+    uint32_t reserved;
+};
+
+static int glyphSlot(wchar_t c) {
+    if(c >= ASCII_FIRST && c <= ASCII_LAST)
+        return c - ASCII_FIRST;
+    if(c >= BOX_FIRST && c <= BOX_LAST)
+        return NASCII + (c - BOX_FIRST);
+    return -1;
+}
+
+static unichar slotGlyph(int slot) {
+    if(slot < NASCII)
+        return ASCII_FIRST + slot;
+    return BOX_FIRST + (slot - NASCII);
+}
+
+static size_t glyphBytes(const struct cache_header *h) {
+    return (size_t)h->pixelWidth * h->pixelHeight * 4;
+}
+
+// FNV-1a, good enough to tell one set of prefs from another
+static uint64_t hashBytes(uint64_t h, const void *p, size_t n) {
+    const unsigned char *b = p;
+    for(size_t i = 0; i < n; ++i) {
+        h ^= b[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static NSString *cachePath() {
+    NSArray *dirs = NSSearchPathForDirectoriesInDomains(NSCachesDirectory,
+        NSUserDomainMask, YES);
+    NSString *dir = [dirs count] ? [dirs objectAtIndex:0]
+        : [NSHomeDirectory() stringByAppendingPathComponent:@"Library/Caches"];
+    dir = [dir stringByAppendingPathComponent:@"Terminal"];
+    return [dir stringByAppendingPathComponent:CACHE_FILE];
+}
+
+@implementation GlyphCache
++ (uint64_t)keyForFontName:(NSString *)name size:(float)size
+    foreground:(uint32_t)fg background:(uint32_t)bg {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char *s = [name UTF8String];
+    h = hashBytes(h, s, strlen(s));
+    h = hashBytes(h, &size, sizeof(size));
+    h = hashBytes(h, &fg, sizeof(fg));
+    h = hashBytes(h, &bg, sizeof(bg));
+    return h;
+}
+
+- (GlyphCache *)initWithKey:(uint64_t)key {
+    self = [super init];
+    _key = key;
+    _cgColorSpace = CGColorSpaceCreateDeviceRGB();
+    _images = calloc(NGLYPHS, sizeof(CGImageRef));
+    [self _mapFile];
+    return self;
+}
+
+- (void)_unmap {
+    for(int i = 0; _images && i < NGLYPHS; ++i) {
+        if(_images[i])
+            CGImageRelease(_images[i]);
+        _images[i] = NULL;
+    }
+    if(_map)
+        munmap(_map, _mapLength);
+    _map = NULL;
+    _mapLength = 0;
+}
+
+- (void)dealloc {
+    [self _unmap];
+    free(_images);
+    if(_cgColorSpace)
+        CGColorSpaceRelease(_cgColorSpace);
+}
+
+// map the cache file and accept it only if it matches our key exactly.
+// Anything else (missing, truncated, stale prefs) leaves us invalid.
+- (BOOL)_mapFile {
+    int fd = open([cachePath() fileSystemRepresentation], O_RDONLY);
+    if(fd < 0)
+        return NO;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return NO;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NO;
+
+    const struct cache_header *h = map;
+    if(h->magic != CACHE_MAGIC || h->version != CACHE_VERSION || h->key != _key
+        || h->nglyphs != NGLYPHS || h->pixelWidth == 0 || h->pixelHeight == 0
+        || st.st_size != sizeof(*h) + NGLYPHS * glyphBytes(h)) {
+        munmap(map, st.st_size);
+        return NO;
+    }
+
+    _map = map;
+    _mapLength = st.st_size;
+    _cellSize = NSMakeSize(h->cellWidth, h->cellHeight);
+    return YES;
+}
+
+- (BOOL)isValid {
+    return _map != NULL;
+}
+
+- (NSSize)cellSize {
+    return _cellSize;
+}
+
+// Rasterize every glyph slot with attrs into cells of the given size and
+// atomically replace the on-disk cache with the result.
+- (BOOL)rebuildWithAttributes:(NSDictionary *)attrs cellSize:(NSSize)size {
+    struct cache_header h = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .key = _key,
+        .cellWidth = size.width,
+        .cellHeight = size.height,
+        .pixelWidth = ceil(size.width),
+        .pixelHeight = ceil(size.height),
+        .nglyphs = NGLYPHS
+    };
+    size_t bytes = glyphBytes(&h);
+    if(bytes == 0)
+        return NO;
+
+    unsigned char *pixels = calloc(NGLYPHS, bytes);
+    if(!pixels)
+        return NO;
+
+    NSColor *bg = [attrs objectForKey:NSBackgroundColorAttributeName];
+    NSRect cell = NSMakeRect(0, 0, h.pixelWidth, h.pixelHeight);
+
+    [NSGraphicsContext saveGraphicsState];
+    for(int slot = 0; slot < NGLYPHS; ++slot) {
+        CGContextRef ctx = CGBitmapContextCreate(pixels + slot * bytes,
+            h.pixelWidth, h.pixelHeight, 8, h.pixelWidth * 4, _cgColorSpace,
+            kCGImageAlphaPremultipliedLast|kCGBitmapByteOrder32Little);
+        if(!ctx)
+            continue;
+        [NSGraphicsContext setCurrentContext:[NSGraphicsContext
+            graphicsContextWithGraphicsPort:ctx flipped:NO]];
+
+        if(bg) {
+            [bg set];
+            NSRectFillUsingOperation(cell, NSCompositeCopy);
+        }
+        unichar ch = slotGlyph(slot);
+        NSAttributedString *as = [[NSAttributedString alloc]
+            initWithString:[NSString stringWithCharacters:&ch length:1]
+            attributes:attrs];
+        [as drawInRect:cell];
+        CGContextRelease(ctx);
+    }
+    [NSGraphicsContext restoreGraphicsState];
+
+    NSString *path = cachePath();
+    [[NSFileManager defaultManager]
+        createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+        withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    // every window is its own process and may rebuild at the same time, so
+    // each writes a private temp file and only a complete one is renamed in
+    char *tmp = strdup([[path stringByAppendingString:@".XXXXXX"]
+        fileSystemRepresentation]);
+    int fd = tmp ? mkstemp(tmp) : -1;
+
+    BOOL ok = NO;
+    if(fd >= 0) {
+        FILE *fp = fdopen(fd, "w");
+        if(fp) {
+            ok = fwrite(&h, sizeof(h), 1, fp) == 1
+                && fwrite(pixels, bytes, NGLYPHS, fp) == NGLYPHS;
+            ok = (fclose(fp) == 0) && ok;
+        } else
+            close(fd);
+        if(ok)
+            ok = rename(tmp, [path fileSystemRepresentation]) == 0;
+        if(!ok)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(pixels);
+
+    [self _unmap];
+    return ok && [self _mapFile];
+}
+
+// Returns an image of the glyph for c in the cached colors, or NULL if c is
+// not one of the cached characters. The image is owned by the cache.
+- (CGImageRef)imageForCharacter:(wchar_t)c {
+    int slot = glyphSlot(c);
+    if(slot < 0 || !_map)
+        return NULL;
+    if(_images[slot])
+        return _images[slot];
+
+    const struct cache_header *h = _map;
+    size_t bytes = glyphBytes(h);
+    const unsigned char *pixels = (const unsigned char *)(h + 1) + slot * bytes;
+
+    CGDataProviderRef provider = CGDataProviderCreateWithData(NULL, pixels, bytes, NULL);
+    _images[slot] = CGImageCreate(h->pixelWidth, h->pixelHeight, 8, 32,
+        h->pixelWidth * 4, _cgColorSpace,
+        kCGImageAlphaPremultipliedLast|kCGBitmapByteOrder32Little,
+        provider, NULL, false, kCGRenderingIntentDefault);
+    CGDataProviderRelease(provider);
+    return _images[slot];
+}
+
+@end
+
@@ -23,6 +23,8 @@
 #import <AppKit/AppKit.h>
 #import <CoreGraphics/CoreGraphics.h>
 #import "tmt.h"
+#import "GlyphCache.h"
+#include "sessionlog.h"
 
 @interface TerminalView: NSView {
     NSSize _termSize; // rows and columns, not pixels
@@ -31,9 +33,15 @@
     NSColor *_bgColor;
     NSColor *_cursorColor;
     NSColor *ansi[9];
-    NSFont *_font;
+    NSFont *_font; // loaded on demand, see -loadFont
+    NSString *_fontName;
+    float _pointSize;
     NSSize _fontSize;
     NSDictionary *_attr;
+    GlyphCache *_glyphCache;
+    BOOL _glyphCacheStale; // rebuild once the first frame is up
+    BOOL _latencyOverlay;
+    SLOG *_log; // session log, if enabled
     NSUserDefaults *_prefs;
     int _pty;
     CGContextRef _screenCtx; // render buffer
@@ -41,9 +49,11 @@
     CGColorSpaceRef _cgColorSpace;
 }
 
++ (NSSize)preferredTerminalSize;
 - (void)updateScreen;
 - (void)handlePTYInput;
 - (void)setPTY:(int)pty;
+- (void)closeSessionLog;
 - (NSSize)terminalSize;
 
 @end
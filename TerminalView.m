@@ -20,9 +20,11 @@
  * THE SOFTWARE.
  */
 
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #import "TerminalView.h"
+#include "latency.h"
 
 NSString * const PREFS_TERM_COLS = @"TerminalColumns";
 NSString * const PREFS_TERM_ROWS = @"TerminalRows";
@@ -31,6 +33,11 @@ NSString * const PREFS_TERM_FONT_SIZE = @"FontSize";
 NSString * const PREFS_FG_COLOR = @"ForegroundColor";
 NSString * const PREFS_BG_COLOR = @"BackgroundColor";
 NSString * const PREFS_CURSOR_COLOR = @"CursorColor";
+NSString * const PREFS_LATENCY_TRACE = @"LatencyTrace";
+NSString * const PREFS_LATENCY_OVERLAY = @"LatencyOverlay";
+NSString * const PREFS_SESSION_LOG_DIR = @"SessionLogDirectory";
+
+static NSString * const GlyphCacheRebuildNotification = @"TerminalGlyphCacheRebuild";
 
 BOOL ready = NO;
 
@@ -72,15 +79,38 @@ static CGFloat hexToFloat(unsigned char hex) {
     return hex / 255.0;
 }
 
+// read a hex RGBA color preference, falling back to def if it is unset or
+// malformed, and store the value actually used back into the defaults
+static uint32_t hexColorPref(NSUserDefaults *prefs, NSString *key, uint32_t def) {
+    uint32_t i = 0;
+    NSString *s = [prefs objectForKey:key];
+    if(s && [s length] == 8)
+        i = strtoul([s cString], NULL, 16);
+    if(i == 0)
+        i = def;
+    [prefs setObject:[NSString stringWithFormat:@"%08X",i] forKey:key];
+    return i;
+}
+
 @implementation TerminalView
++ (NSSize)preferredTerminalSize {
+    NSUserDefaults *prefs = [NSUserDefaults standardUserDefaults];
+    NSSize size;
+
+    int cols = [prefs integerForKey:PREFS_TERM_COLS]; 
+    size.width = cols <= 0 ? 80 : MAX(40, cols);
+    int rows = [prefs integerForKey:PREFS_TERM_ROWS]; 
+    size.height = rows <= 0 ? 25 : MAX(10, rows);
+    return size;
+}
+
+// Everything here runs before the window appears, so keep it cheap. The font
+// is only loaded and measured if the glyph cache can't give us the metrics.
 - (TerminalView *)init {
     _screenCtx = NULL;
     _prefs = [NSUserDefaults standardUserDefaults];
 
-    int cols = [_prefs integerForKey:PREFS_TERM_COLS]; 
-    _termSize.width = cols <= 0 ? 80 : MAX(40, cols);
-    int rows = [_prefs integerForKey:PREFS_TERM_ROWS]; 
-    _termSize.height = rows <= 0 ? 25 : MAX(10, rows);
+    _termSize = [TerminalView preferredTerminalSize];
     [_prefs setInteger:_termSize.width forKey:PREFS_TERM_COLS];
     [_prefs setInteger:_termSize.height forKey:PREFS_TERM_ROWS];
 
@@ -90,51 +120,41 @@ static CGFloat hexToFloat(unsigned char hex) {
     if(!_tmt)
         return nil;
 
-    NSString *s = [_prefs objectForKey:PREFS_TERM_FONT_NAME];
-    if(!s)
-        s = @"NimbusMonoPS-Regular";
-    float pointsize = [_prefs floatForKey:PREFS_TERM_FONT_SIZE];
-    if(pointsize < 2.0)
-        pointsize = 13.0;
-    [_prefs setObject:s forKey:PREFS_TERM_FONT_NAME];
-    [_prefs setFloat:pointsize forKey:PREFS_TERM_FONT_SIZE];
-
-    _font = [NSFont fontWithName:s size:pointsize];
-
-    unsigned int i = 0;
-    s = [_prefs objectForKey:PREFS_FG_COLOR];
-    if(s && [s length] == 8)
-        i = strtoul([s cString], NULL, 16);
-    if(i == 0)
-        i = 0xFFFFFFFF; // fully opaque white
-    _fgColor = colorWithHexRGBA(i);
-    [_prefs setObject:[NSString stringWithFormat:@"%08X",i] forKey:PREFS_FG_COLOR];
-
-    i = 0;
-    s = [_prefs objectForKey:PREFS_BG_COLOR]; 
-    if(s && [s length] == 8)
-        i = strtoul([s cString], NULL, 16);
-    if(i == 0)
-        i = 0x101010F0;
-    _bgColor = colorWithHexRGBA(i);
-    [_prefs setObject:[NSString stringWithFormat:@"%08X",i] forKey:PREFS_BG_COLOR];
-
-    _attr = [NSDictionary dictionaryWithObjects:@[_font, _fgColor, _bgColor]
-        forKeys:@[NSFontAttributeName,NSForegroundColorAttributeName,
-        NSBackgroundColorAttributeName]];
-    NSAttributedString *as = [[NSAttributedString alloc] initWithString:@"M" attributes:_attr];
-    _fontSize = [as size];
-
-    i = 0;
-    s = [_prefs objectForKey:PREFS_CURSOR_COLOR];
-    if(s && [s length] == 8)
-        i = strtoul([s cString], NULL, 16);
-    if(i == 0)
-        i = 0x333333FF; // fully opaque dark gray
-    _cursorColor = colorWithHexRGBA(i);
-    [_prefs setObject:[NSString stringWithFormat:@"%08X",i] forKey:PREFS_CURSOR_COLOR];
-
-    [_prefs synchronize];
+    _fontName = [_prefs objectForKey:PREFS_TERM_FONT_NAME];
+    if(!_fontName)
+        _fontName = @"NimbusMonoPS-Regular";
+    _pointSize = [_prefs floatForKey:PREFS_TERM_FONT_SIZE];
+    if(_pointSize < 2.0)
+        _pointSize = 13.0;
+    [_prefs setObject:_fontName forKey:PREFS_TERM_FONT_NAME];
+    [_prefs setFloat:_pointSize forKey:PREFS_TERM_FONT_SIZE];
+
+    uint32_t fg = hexColorPref(_prefs, PREFS_FG_COLOR, 0xFFFFFFFF); // fully opaque white
+    _fgColor = colorWithHexRGBA(fg);
+    uint32_t bg = hexColorPref(_prefs, PREFS_BG_COLOR, 0x101010F0);
+    _bgColor = colorWithHexRGBA(bg);
+    _cursorColor = colorWithHexRGBA(hexColorPref(_prefs, PREFS_CURSOR_COLOR,
+        0x333333FF)); // fully opaque dark gray
+
+    lat_enable([_prefs boolForKey:PREFS_LATENCY_TRACE]);
+    _latencyOverlay = lat_enabled() && [_prefs boolForKey:PREFS_LATENCY_OVERLAY];
+
+    [self openSessionLog];
+
+    // write back any defaults we filled in once we are up and running
+    [_prefs performSelector:@selector(synchronize) withObject:nil afterDelay:0];
+
+    _glyphCache = [[GlyphCache alloc] initWithKey:[GlyphCache
+        keyForFontName:_fontName size:_pointSize foreground:fg background:bg]];
+    if([_glyphCache isValid])
+        _fontSize = [_glyphCache cellSize];
+    else {
+        [self loadFont];
+        _glyphCacheStale = YES;
+        [[NSNotificationCenter defaultCenter] addObserver:self
+            selector:@selector(rebuildGlyphCache:)
+            name:GlyphCacheRebuildNotification object:self];
+    }
 
     ansi[TMT_COLOR_BLACK] = [NSColor blackColor];
     ansi[TMT_COLOR_RED] = [NSColor redColor];
@@ -149,8 +169,64 @@ static CGFloat hexToFloat(unsigned char hex) {
     return [self initWithFrame:frame];
 }
 
+- (void)loadFont {
+    if(_font)
+        return;
+
+    _font = [NSFont fontWithName:_fontName size:_pointSize];
+    _attr = [NSDictionary dictionaryWithObjects:@[_font, _fgColor, _bgColor]
+        forKeys:@[NSFontAttributeName,NSForegroundColorAttributeName,
+        NSBackgroundColorAttributeName]];
+
+    // cell size comes from the cache if we have one, so the two always agree
+    if(![_glyphCache isValid]) {
+        NSAttributedString *as = [[NSAttributedString alloc] initWithString:@"M" attributes:_attr];
+        _fontSize = [as size];
+    }
+}
+
+// posted at idle priority from the first drawRect: with content, so the
+// rasterizing never gets in the way of the first prompt
+- (void)rebuildGlyphCache:(NSNotification *)note {
+    [[NSNotificationCenter defaultCenter] removeObserver:self
+        name:GlyphCacheRebuildNotification object:self];
+    [self loadFont];
+    if(![_glyphCache rebuildWithAttributes:_attr cellSize:_fontSize])
+        NSLog(@"unable to write glyph cache");
+}
+
+// Log all pty output to a new compressed file in the configured directory.
+// The writes happen on a background thread; see sessionlog.c.
+- (void)openSessionLog {
+    NSString *dir = [[_prefs objectForKey:PREFS_SESSION_LOG_DIR] stringByExpandingTildeInPath];
+    if(![dir length])
+        return;
+
+    [[NSFileManager defaultManager] createDirectoryAtPath:dir
+        withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    NSString *path = [dir stringByAppendingPathComponent:[NSString
+        stringWithFormat:@"session-%s-%d.tlog", stamp, getpid()]];
+
+    _log = slog_open([path fileSystemRepresentation]);
+    if(!_log)
+        NSLog(@"unable to open session log %@", path);
+}
+
+- (void)closeSessionLog {
+    if(_log && slog_dropped(_log))
+        NSLog(@"session log dropped %llu bytes", (unsigned long long)slog_dropped(_log));
+    slog_close(_log);
+    _log = NULL;
+}
+
 - (void)dealloc {
     ready = NO; // stop any callbacks
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [self closeSessionLog];
     if(_tmt)
         tmt_close(_tmt);
     if(_screenCtx)
@@ -178,30 +254,41 @@ static CGFloat hexToFloat(unsigned char hex) {
     [NSGraphicsContext saveGraphicsState];
     [NSGraphicsContext setCurrentContext:_screenNSCtx];
 
-    NSMutableDictionary *attrs = [NSMutableDictionary new];
-    [attrs setDictionary:_attr];
+    NSMutableDictionary *attrs = nil;
 
     // render the screen
-    char buffer[screen->ncol + 1];
+    char buffer[4 * screen->ncol + 1]; // worst case UTF-8
     for(size_t row = 0; row < screen->nline; ++row) {
         if(screen->lines[row]->dirty) {
-            for(size_t col = 0; col < screen->ncol; ++col) {
-                buffer[col] = screen->lines[row]->chars[col].c;
+            if([self drawCachedLine:screen->lines[row] row:row columns:screen->ncol])
+                continue;
+
+            if(!attrs) {
+                [self loadFont];
+                attrs = [NSMutableDictionary new];
+                [attrs setDictionary:_attr];
             }
-            buffer[screen->ncol] = 0;
-            
+            // keep trailing blanks so their background still gets painted
+            TMTPOINT start = {row, 0}, end = {row, screen->ncol - 1};
+            tmt_export(_tmt, &start, &end, TMT_EXPORT_NOTRIM, buffer, sizeof(buffer));
+
             NSString *str = [[NSString alloc] initWithUTF8String:buffer];
             NSMutableAttributedString *as = [[NSMutableAttributedString alloc]
                 initWithString:str attributes:attrs];
-            for(size_t col = 0; col < screen->ncol; ++col) {
+            NSUInteger length = [as length], offset = 0;
+            for(size_t col = 0; col < screen->ncol && offset < length; ++col) {
                 int fg = screen->lines[row]->chars[col].a.fg;
                 int bg = screen->lines[row]->chars[col].a.bg;
                 [attrs setObject:(fg > 0 && fg < TMT_COLOR_MAX) ? ansi[fg] : _fgColor
                     forKey:NSForegroundColorAttributeName];
                 [attrs setObject:(bg > 0 && bg < TMT_COLOR_MAX) ? ansi[bg] : _bgColor
                     forKey:NSBackgroundColorAttributeName];
-                int length = [as length];
-                [as setAttributes:attrs range:NSMakeRange(col,(col+1 > length) ? 0 : 1)];
+
+                // characters above U+FFFF take two UTF-16 units in the string
+                wchar_t c = screen->lines[row]->chars[col].c;
+                NSUInteger units = (c >= 0x10000 && c < 0x110000) ? 2 : 1;
+                [as setAttributes:attrs range:NSMakeRange(offset, MIN(units, length - offset))];
+                offset += units;
             }
             NSRect lineRect = NSMakeRect(0, _frame.size.height - ((1 + row) * _fontSize.height),
                 _frame.size.width, _fontSize.height);
@@ -211,9 +298,48 @@ static CGFloat hexToFloat(unsigned char hex) {
 
     [NSGraphicsContext restoreGraphicsState];
     tmt_clean(_tmt);
+    lat_mark(LAT_RENDERED);
     [self setNeedsDisplay:YES];
 }
 
+// Draw a line straight from the glyph cache. Only works when every cell is
+// in the default colors and has a cached glyph; returns NO otherwise so the
+// caller can fall back to laying out the text.
+- (BOOL)drawCachedLine:(const TMTLINE *)line row:(size_t)row columns:(size_t)ncol {
+    if(![_glyphCache isValid])
+        return NO;
+
+    CGImageRef images[ncol];
+    for(size_t col = 0; col < ncol; ++col) {
+        const TMTCHAR *ch = &line->chars[col];
+        if((ch->a.fg > 0 && ch->a.fg < TMT_COLOR_MAX) ||
+            (ch->a.bg > 0 && ch->a.bg < TMT_COLOR_MAX))
+            return NO;
+        if(!(images[col] = [_glyphCache imageForCharacter:ch->c]))
+            return NO;
+    }
+
+    // The cell size is fractional but the glyphs were rasterized at whole
+    // pixels, so draw them unscaled at pixel-aligned origins. Each cell is
+    // copied over the previous one's overhang and the line clip trims the
+    // last, leaving every cell exactly its own width.
+    CGFloat top = floor(_frame.size.height - row * _fontSize.height);
+    CGFloat bottom = floor(_frame.size.height - (row + 1) * _fontSize.height);
+    CGRect lineRect = CGRectMake(0, bottom, _frame.size.width, top - bottom);
+
+    CGContextSaveGState(_screenCtx);
+    CGContextClipToRect(_screenCtx, lineRect);
+    CGContextClearRect(_screenCtx, lineRect);
+    CGContextSetBlendMode(_screenCtx, kCGBlendModeCopy);
+    for(size_t col = 0; col < ncol; ++col) {
+        size_t w = CGImageGetWidth(images[col]), h = CGImageGetHeight(images[col]);
+        CGRect cell = CGRectMake(floor(col * _fontSize.width), top - h, w, h);
+        CGContextDrawImage(_screenCtx, cell, images[col]);
+    }
+    CGContextRestoreGState(_screenCtx);
+    return YES;
+}
+
 - (void)drawRect:(NSRect)dirtyRect {
     if(!_screenCtx) {
         return;
@@ -232,6 +358,22 @@ static CGFloat hexToFloat(unsigned char hex) {
     cursor.size = _fontSize;
     [_cursorColor set]; 
     [NSBezierPath fillRect:cursor];
+
+    if(_latencyOverlay) {
+        char stats[512];
+        lat_format(stats, sizeof(stats));
+        [self loadFont];
+        [[NSString stringWithUTF8String:stats] drawAtPoint:NSMakePoint(4, 4)
+            withAttributes:_attr];
+    }
+    lat_mark(LAT_DRAWN);
+
+    if(_glyphCacheStale) {
+        _glyphCacheStale = NO;
+        [[NSNotificationQueue defaultQueue] enqueueNotification:[NSNotification
+            notificationWithName:GlyphCacheRebuildNotification object:self]
+            postingStyle:NSPostWhenIdle];
+    }
 }
 
 - (void)setFrame:(NSRect)frame {
@@ -253,14 +395,20 @@ static CGFloat hexToFloat(unsigned char hex) {
 - (void)handlePTYInput {
     static char buf[16384];
     int bytes = read(_pty, buf, sizeof(buf));
-    if(bytes)
+    if(bytes > 0) {
+        lat_mark(LAT_ECHO);
+        if(_log)
+            slog_write(_log, buf, bytes);
         tmt_write(_tmt, buf, bytes);
+        lat_mark(LAT_PARSED);
+    }
 }
 
 - (void)keyDown:(NSEvent *)event {
     if([[event characters] length] <= 0)
         return;
 
+    lat_mark(LAT_KEYDOWN);
     unichar ch = [[event characters] characterAtIndex:0];
     char *s = [[event characters] UTF8String];
 
@@ -326,6 +474,7 @@ static CGFloat hexToFloat(unsigned char hex) {
             write(_pty, s, strlen(s));
             break;
     }
+    lat_mark(LAT_PTY_WRITE);
 
     // FIXME: handle key repeat if held down
     // want to get global repeat delay and rate from WindowServer config
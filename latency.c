@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2024 Zoe Knox <zoe@pixin.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <time.h>
+#include "latency.h"
+
+#define MAX_INFLIGHT    64  // keystrokes awaiting their echo or redraw
+#define MAX_AGE_NS      10000000000ULL  // give up on an echo after 10s
+
+// Log-linear histogram buckets: values below 8ns get their own bucket, and
+// every power of two above that is split into 8 sub-buckets, so percentiles
+// are within 12.5% of the true value across the whole 64-bit range.
+#define SUB_BITS        3
+#define SUB_BUCKETS     (1 << SUB_BITS)
+#define NBUCKETS        ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct keystroke {
+    uint64_t t[LAT_NSTAGES];    // 0 until the stage has been reached
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint32_t buckets[NBUCKETS];
+};
+
+static bool enabled = false;
+static struct keystroke inflight[MAX_INFLIGHT];
+static size_t head = 0, ninflight = 0;
+static uint64_t dropped = 0;
+static struct histogram hist[LAT_NSTAGES];
+
+static const char *stageNames[LAT_NSTAGES] = {
+    "keydown", "write", "echo", "parsed", "rendered", "drawn"
+};
+
+static size_t bucketFor(uint64_t v) {
+    if(v < SUB_BUCKETS)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + ((v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// largest value that lands in bucket b
+static uint64_t bucketLimit(size_t b) {
+    if(b < SUB_BUCKETS)
+        return b;
+    int e = b / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = b % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (e - SUB_BITS)) - 1;
+}
+
+static void record(struct histogram *h, uint64_t v) {
+    h->buckets[bucketFor(v)]++;
+    h->count++;
+    if(v > h->max)
+        h->max = v;
+}
+
+static uint64_t percentile(const struct histogram *h, double p) {
+    if(!h->count)
+        return 0;
+    uint64_t want = (uint64_t)(h->count * p);
+    if(want >= h->count)
+        want = h->count - 1;
+    uint64_t seen = 0;
+    for(size_t b = 0; b < NBUCKETS; ++b) {
+        seen += h->buckets[b];
+        if(seen > want) {
+            uint64_t v = bucketLimit(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static struct keystroke *entry(size_t i) {
+    return &inflight[(head + i) % MAX_INFLIGHT];
+}
+
+// forget the oldest keystroke without recording anything for it
+static void discard(void) {
+    memset(entry(0), 0, sizeof(struct keystroke));
+    head = (head + 1) % MAX_INFLIGHT;
+    ninflight--;
+    dropped++;
+}
+
+// Keys that are never echoed (passwords, pager and editor commands, ^C)
+// would otherwise be matched with some unrelated later read, so a key still
+// waiting for its echo after far longer than any real stall is assumed not
+// to echo. Keys that have been echoed stay until they are drawn, however
+// slow that is, so the worst cases still reach the histograms.
+static void expire(uint64_t now) {
+    while(ninflight && !entry(0)->t[LAT_ECHO]
+        && now - entry(0)->t[LAT_KEYDOWN] > MAX_AGE_NS)
+        discard();
+}
+
+// the keystroke is on screen, so account for it and drop it from the queue
+static void retire(void) {
+    struct keystroke *k = entry(0);
+    for(int s = LAT_PTY_WRITE; s < LAT_NSTAGES; ++s)
+        if(k->t[s])
+            record(&hist[s], k->t[s] - k->t[LAT_KEYDOWN]);
+    memset(k, 0, sizeof(*k));
+    head = (head + 1) % MAX_INFLIGHT;
+    ninflight--;
+}
+
+void lat_enable(bool on) {
+    enabled = on;
+}
+
+bool lat_enabled(void) {
+    return enabled;
+}
+
+uint64_t lat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void lat_mark(lat_stage_t stage) {
+    if(!enabled)
+        return;
+
+    uint64_t now = lat_now();
+    switch(stage) {
+        case LAT_KEYDOWN:
+            expire(now);
+            if(ninflight == MAX_INFLIGHT)
+                discard(); // nothing is being echoed; forget the oldest key
+            entry(ninflight++)->t[LAT_KEYDOWN] = now;
+            break;
+        case LAT_PTY_WRITE:
+            if(ninflight && !entry(ninflight - 1)->t[LAT_PTY_WRITE])
+                entry(ninflight - 1)->t[LAT_PTY_WRITE] = now;
+            break;
+        case LAT_ECHO:
+            // the first read after a write is taken as its echo. Keys typed
+            // ahead of a slow child are all echoed by the same read.
+            expire(now);
+            for(size_t i = 0; i < ninflight; ++i) {
+                struct keystroke *k = entry(i);
+                if(k->t[LAT_PTY_WRITE] && !k->t[LAT_ECHO])
+                    k->t[LAT_ECHO] = now;
+            }
+            break;
+        case LAT_PARSED:
+        case LAT_RENDERED:
+            // updateScreen runs inside tmt_write() so these can come in
+            // either order; both only need the echo to have arrived
+            for(size_t i = 0; i < ninflight; ++i) {
+                struct keystroke *k = entry(i);
+                if(k->t[LAT_ECHO] && !k->t[stage])
+                    k->t[stage] = now;
+            }
+            break;
+        case LAT_DRAWN:
+            while(ninflight && entry(0)->t[LAT_ECHO]) {
+                entry(0)->t[LAT_DRAWN] = now;
+                retire();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void lat_reset(void) {
+    memset(inflight, 0, sizeof(inflight));
+    memset(hist, 0, sizeof(hist));
+    head = ninflight = 0;
+    dropped = 0;
+}
+
+void lat_summary(lat_stage_t stage, lat_summary_t *out) {
+    memset(out, 0, sizeof(*out));
+    if(stage <= LAT_KEYDOWN || stage >= LAT_NSTAGES)
+        return;
+    out->count = hist[stage].count;
+    out->p50 = percentile(&hist[stage], 0.50);
+    out->p99 = percentile(&hist[stage], 0.99);
+    out->max = hist[stage].max;
+    out->dropped = dropped;
+}
+
+// the dropped count, then one line per stage with times in microseconds,
+// suitable for an overlay
+size_t lat_format(char *buf, size_t n) {
+    size_t len = 0;
+    if(n)
+        buf[0] = 0;
+
+    int r = snprintf(buf, n, "dropped  n=%llu\n", (unsigned long long)dropped);
+    if(r > 0)
+        len = r;
+
+    for(int s = LAT_PTY_WRITE; s < LAT_NSTAGES && len < n; ++s) {
+        lat_summary_t sum;
+        lat_summary(s, &sum);
+        r = snprintf(buf + len, n - len,
+            "%-8s n=%-6llu p50=%7.1fus p99=%7.1fus max=%7.1fus\n",
+            stageNames[s], (unsigned long long)sum.count, sum.p50 / 1000.0,
+            sum.p99 / 1000.0, sum.max / 1000.0);
+        if(r < 0)
+            break;
+        len += r;
+    }
+    return len < n ? len : n ? n - 1 : 0;
+}
+
+void lat_dump(FILE *fp) {
+    char buf[512];
+    lat_format(buf, sizeof(buf));
+    fprintf(fp, "keystroke latency since keydown:\n%s", buf);
+    fflush(fp);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2024 Zoe Knox <zoe@pixin.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Keystroke-to-pixel latency tracing. Each keystroke is timestamped as it
+ * passes through the stages below and correlated with the first PTY read
+ * that follows its write, which is normally the echo. Once a keystroke has
+ * been drawn, the time from keyDown: to each stage goes into a histogram.
+ *
+ * This is plain C with no AppKit dependency so a headless harness driving a
+ * pty can link it and mark the stages itself. All calls are expected from a
+ * single thread and are no-ops unless tracing is enabled.
+ */
+typedef enum {
+    LAT_KEYDOWN,        // keyDown: received
+    LAT_PTY_WRITE,      // key sequence written to the pty
+    LAT_ECHO,           // first bytes read back from the pty
+    LAT_PARSED,         // tmt_write() returned
+    LAT_RENDERED,       // updateScreen finished
+    LAT_DRAWN,          // drawRect: finished
+    LAT_NSTAGES
+} lat_stage_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t p50;       // all times are in nanoseconds since keyDown:
+    uint64_t p99;
+    uint64_t max;
+    uint64_t dropped;   // keystrokes given up on without an echo
+} lat_summary_t;
+
+void lat_enable(bool on);
+bool lat_enabled(void);
+uint64_t lat_now(void);
+void lat_mark(lat_stage_t stage);
+void lat_reset(void);
+void lat_summary(lat_stage_t stage, lat_summary_t *out);
+size_t lat_format(char *buf, size_t n);
+void lat_dump(FILE *fp);
+
+#endif
@@ -58,14 +58,10 @@ int main(int argc, const char *argv[]) {
     __NSInitializeProcess(argc, argv);
 
     NSAutoreleasePool *pool = [NSAutoreleasePool new];
-    [NSApplication sharedApplication];
 
-    AppDelegate *del = [AppDelegate new];
-    if(!del)
-        exit(EXIT_FAILURE);
-    [NSApp setDelegate:del];
-
-    NSSize size = [del terminalSize];
+    // start the shell first so it initializes while we bring up the UI.
+    // Only the terminal size is needed and that comes straight from prefs.
+    NSSize size = [TerminalView preferredTerminalSize];
     struct winsize ws = {.ws_row = size.height, .ws_col = size.width};
     int pty;
 
@@ -79,6 +75,13 @@ int main(int argc, const char *argv[]) {
         return -1;
     }
 
+    [NSApplication sharedApplication];
+
+    AppDelegate *del = [AppDelegate new];
+    if(!del)
+        exit(EXIT_FAILURE);
+    [NSApp setDelegate:del];
+
     NSSelectInputSource *inputSource = [NSSelectInputSource 
         socketInputSourceWithSocket:[NSSocket_bsd socketWithDescriptor:pty]];
     [inputSource setDelegate:del];
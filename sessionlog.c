@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2024 Zoe Knox <zoe@pixin.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sessionlog.h"
+
+#define RING_SIZE       (4 * 1024 * 1024)   // must be a power of two
+#define OUT_SIZE        (1024 * 1024)       // batch this much before writing
+#define MAX_INDEX       64                  // index entries held per batch
+#define FLUSH_NS        1000000000ULL       // bytes reach the disk within 1s
+
+// codec parameters, the same constraints as the LZ4 block format
+#define MINMATCH        4
+#define LASTLITERALS    5
+#define MFLIMIT         12
+#define MAX_OFFSET      65535
+#define HASH_BITS       12
+
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
+
+struct SLOG {
+    int fd;
+    int idxfd;
+    pthread_t thread;
+
+    // shared between the producer and the writer thread
+    char *ring;
+    _Atomic size_t head;        // only advanced by slog_write()
+    _Atomic size_t tail;        // only advanced by the writer thread
+    _Atomic bool stop;
+    _Atomic bool sleeping;      // writer is (about to be) waiting on wake
+    _Atomic uint64_t dropped;
+    sem_t wake;
+
+    // everything below belongs to the writer thread
+    char *block;
+    size_t nblock;
+    uint64_t blockStart;        // when the oldest byte in block arrived
+    char *out;
+    size_t nout;
+    size_t outRaw;              // uncompressed bytes batched in out
+    uint64_t outStart;          // when the oldest byte in out arrived
+    SLOGINDEX index[MAX_INDEX];
+    size_t nindex;
+    uint64_t rawOffset;
+    uint64_t fileOffset;
+    uint64_t idxOffset;         // size of the index file
+    uint64_t nextIndex;
+};
+
+static uint64_t nanotime(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static unsigned char *putLength(unsigned char *op, size_t len) {
+    for(; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Emit one sequence: the literals from anchor up to ip, then a match of
+// mlen bytes at offset off (mlen == 0 for the final literal-only sequence).
+// Returns NULL if it won't fit.
+static unsigned char *putSequence(unsigned char *op, const unsigned char *oend,
+    const unsigned char *anchor, size_t nlit, size_t off, size_t mlen) {
+    size_t worst = 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1;
+    if(worst > (size_t)(oend - op))
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = (nlit >= 15 ? 15 : nlit) << 4;
+    if(nlit >= 15)
+        op = putLength(op, nlit - 15);
+    memcpy(op, anchor, nlit);
+    op += nlit;
+
+    if(mlen) {
+        *op++ = off & 0xFF;
+        *op++ = off >> 8;
+        mlen -= MINMATCH;
+        *token |= mlen >= 15 ? 15 : mlen;
+        if(mlen >= 15)
+            op = putLength(op, mlen - 15);
+    }
+    return op;
+}
+
+// Greedy LZ77 with a single-entry hash table, written in the LZ4 block
+// layout. Returns the compressed size, or 0 if it doesn't fit in cap.
+size_t slog_compress(const char *src, size_t n, char *dst, size_t cap) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *end = base + n;
+    unsigned char *op = (unsigned char *)dst;
+    const unsigned char *oend = op + cap;
+    uint32_t table[1 << HASH_BITS];
+    unsigned misses = 0;
+
+    memset(table, 0, sizeof(table));
+    if(n > MFLIMIT) {
+        const unsigned char *mflimit = end - MFLIMIT;
+        const unsigned char *matchlimit = end - LASTLITERALS;
+
+        while(ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const unsigned char *ref = base + table[h];
+            table[h] = ip - base;
+
+            if(ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                // skip ahead faster through data that doesn't compress
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            const unsigned char *m = ip + MINMATCH, *r = ref + MINMATCH;
+            while(m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            op = putSequence(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+            if(!op)
+                return 0;
+            ip = anchor = m;
+        }
+    }
+
+    op = putSequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - (unsigned char *)dst : 0;
+}
+
+// Returns the decompressed size, or 0 if the input is malformed or the
+// output doesn't fit in cap.
+size_t slog_decompress(const char *src, size_t n, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+
+    while(ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        if(len == 15) {
+            unsigned char b;
+            do {
+                if(ip >= iend)
+                    return 0;
+                len += b = *ip++;
+            } while(b == 255);
+        }
+        if(len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return 0;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        if(ip == iend)
+            break; // the last sequence has no match
+
+        if(iend - ip < 2)
+            return 0;
+        size_t off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(off == 0 || off > (size_t)(op - (unsigned char *)dst))
+            return 0;
+
+        len = token & 15;
+        if(len == 15) {
+            unsigned char b;
+            do {
+                if(ip >= iend)
+                    return 0;
+                len += b = *ip++;
+            } while(b == 255);
+        }
+        len += MINMATCH;
+        if(len > (size_t)(oend - op))
+            return 0;
+
+        // the match may overlap what it is producing, so go bytewise
+        const unsigned char *r = op - off;
+        while(len--)
+            *op++ = *r++;
+    }
+    return op - (unsigned char *)dst;
+}
+
+static bool writeAll(int fd, const char *buf, size_t n) {
+    while(n) {
+        ssize_t w = write(fd, buf, n);
+        if(w < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += w;
+        n -= w;
+    }
+    return true;
+}
+
+static void flushOut(SLOG *log) {
+    if(log->nout && !writeAll(log->fd, log->out, log->nout)) {
+        // Cut off anything partially written so the log stays decodable,
+        // and forget the whole batch, including its index entries. If that
+        // fails too, at least keep later index entries pointing at the end.
+        if(ftruncate(log->fd, log->fileOffset) < 0) {
+            off_t end = lseek(log->fd, 0, SEEK_END);
+            if(end > 0)
+                log->fileOffset = end;
+        }
+        atomic_fetch_add(&log->dropped, log->outRaw);
+        log->rawOffset -= log->outRaw;
+        if(log->nindex)
+            log->nextIndex = log->rawOffset;
+        log->nindex = 0;
+    } else {
+        log->fileOffset += log->nout;
+
+        // only point at blocks once they are on disk
+        size_t n = log->nindex * sizeof(SLOGINDEX);
+        if(n && log->idxfd >= 0) {
+            if(writeAll(log->idxfd, (const char *)log->index, n))
+                log->idxOffset += n;
+            else if(ftruncate(log->idxfd, log->idxOffset) < 0) {
+                // a partial entry would misalign every one after it
+                close(log->idxfd);
+                log->idxfd = -1;
+            }
+        }
+        log->nindex = 0;
+    }
+    log->nout = 0;
+    log->outRaw = 0;
+}
+
+static void emitBlock(SLOG *log) {
+    if(log->nout + sizeof(SLOGBLOCK) + SLOG_BLOCK_SIZE > OUT_SIZE
+        || log->nindex == MAX_INDEX)
+        flushOut(log);
+
+    SLOGBLOCK hdr = {
+        .magic = SLOG_MAGIC,
+        .rawLen = log->nblock,
+        .time = nanotime(CLOCK_REALTIME)
+    };
+
+    if(log->rawOffset >= log->nextIndex) {
+        log->index[log->nindex++] = (SLOGINDEX){
+            .rawOffset = log->rawOffset,
+            .fileOffset = log->fileOffset + log->nout,
+            .time = hdr.time
+        };
+        log->nextIndex = log->rawOffset + SLOG_INDEX_INTERVAL;
+    }
+
+    char *data = log->out + log->nout + sizeof(hdr);
+    hdr.compLen = slog_compress(log->block, log->nblock, data, log->nblock - 1);
+    if(hdr.compLen == 0) {
+        hdr.flags = SLOG_STORED;
+        hdr.compLen = log->nblock;
+        memcpy(data, log->block, log->nblock);
+    }
+    memcpy(log->out + log->nout, &hdr, sizeof(hdr));
+    if(!log->nout)
+        log->outStart = log->blockStart;
+    log->nout += sizeof(hdr) + hdr.compLen;
+    log->outRaw += log->nblock;
+
+    log->rawOffset += log->nblock;
+    log->nblock = 0;
+}
+
+// move whatever the producer has published into the current block
+static size_t drain(SLOG *log) {
+    size_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    size_t n = MIN(head - tail, SLOG_BLOCK_SIZE - log->nblock);
+    if(!n)
+        return 0;
+
+    size_t off = tail & (RING_SIZE - 1);
+    size_t k = MIN(n, RING_SIZE - off);
+    memcpy(log->block + log->nblock, log->ring + off, k);
+    memcpy(log->block + log->nblock + k, log->ring, n - k);
+    atomic_store_explicit(&log->tail, tail + n, memory_order_release);
+
+    if(!log->nblock)
+        log->blockStart = nanotime(CLOCK_MONOTONIC);
+    log->nblock += n;
+    return n;
+}
+
+// Sleep until the producer posts more data, or until the next flush is due
+// if anything is still pending. Going through sleeping means slog_write()
+// only touches the semaphore while the writer is actually idle.
+static void waitForData(SLOG *log, uint64_t now) {
+    atomic_store(&log->sleeping, true);
+    if(atomic_load(&log->head) == atomic_load(&log->tail) && !atomic_load(&log->stop)) {
+        if(log->nblock || log->nout) {
+            uint64_t deadline = UINT64_MAX;
+            if(log->nblock)
+                deadline = log->blockStart + FLUSH_NS;
+            if(log->nout)
+                deadline = MIN(deadline, log->outStart + FLUSH_NS);
+
+            // sem_timedwait() wants a wall clock time
+            uint64_t until = nanotime(CLOCK_REALTIME) + (deadline > now ? deadline - now : 0);
+            struct timespec ts = { until / 1000000000ULL, until % 1000000000ULL };
+            while(sem_timedwait(&log->wake, &ts) < 0 && errno == EINTR)
+                ;
+        } else {
+            while(sem_wait(&log->wake) < 0 && errno == EINTR)
+                ;
+        }
+    }
+    atomic_store(&log->sleeping, false);
+}
+
+static void *writerThread(void *arg) {
+    SLOG *log = arg;
+
+    for(;;) {
+        // check before draining so nothing written ahead of slog_close()
+        // can be missed
+        bool stopping = atomic_load_explicit(&log->stop, memory_order_acquire);
+        size_t got = drain(log);
+        uint64_t now = nanotime(CLOCK_MONOTONIC);
+
+        if(log->nblock == SLOG_BLOCK_SIZE || (log->nblock
+            && (stopping || now - log->blockStart >= FLUSH_NS)))
+            emitBlock(log);
+        if(log->nout && (stopping || now - log->outStart >= FLUSH_NS))
+            flushOut(log);
+
+        if(!got) {
+            if(stopping && !log->nblock)
+                break;
+            waitForData(log, now);
+        }
+    }
+    flushOut(log);
+    return NULL;
+}
+
+static void freeLog(SLOG *log) {
+    if(log->fd >= 0)
+        close(log->fd);
+    if(log->idxfd >= 0)
+        close(log->idxfd);
+    free(log->ring);
+    free(log->block);
+    free(log->out);
+    sem_destroy(&log->wake);
+    free(log);
+}
+
+SLOG *slog_open(const char *path) {
+    SLOG *log = calloc(1, sizeof(SLOG));
+    if(!log)
+        return NULL;
+    log->fd = log->idxfd = -1;
+    if(sem_init(&log->wake, 0, 0) < 0) {
+        free(log);
+        return NULL;
+    }
+
+    size_t len = strlen(path);
+    char idx[len + sizeof(".idx")];
+    memcpy(idx, path, len);
+    memcpy(idx + len, ".idx", sizeof(".idx"));
+
+    // session logs can hold anything typed at a prompt; keep them private
+    log->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+    log->idxfd = open(idx, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+    log->ring = malloc(RING_SIZE);
+    log->block = malloc(SLOG_BLOCK_SIZE);
+    log->out = malloc(OUT_SIZE);
+    if(log->fd < 0 || log->idxfd < 0 || !log->ring || !log->block || !log->out) {
+        freeLog(log);
+        return NULL;
+    }
+
+    off_t end = lseek(log->fd, 0, SEEK_END);
+    log->fileOffset = end > 0 ? end : 0;
+    end = lseek(log->idxfd, 0, SEEK_END);
+    log->idxOffset = end > 0 ? end : 0;
+
+    if(pthread_create(&log->thread, NULL, writerThread, log) != 0) {
+        freeLog(log);
+        return NULL;
+    }
+    return log;
+}
+
+// Called on the PTY read path: never blocks, never allocates. If the
+// writer has fallen a whole ring behind, the chunk is dropped and counted.
+void slog_write(SLOG *log, const char *s, size_t n) {
+    size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+    if(n > RING_SIZE - (head - tail)) {
+        atomic_fetch_add_explicit(&log->dropped, n, memory_order_relaxed);
+        return;
+    }
+
+    size_t off = head & (RING_SIZE - 1);
+    size_t k = MIN(n, RING_SIZE - off);
+    memcpy(log->ring + off, s, k);
+    memcpy(log->ring, s + k, n - k);
+    // pairs with waitForData(): either the writer sees the new head or we
+    // see it sleeping. sem_post() never blocks.
+    atomic_store(&log->head, head + n);
+    if(atomic_load(&log->sleeping))
+        sem_post(&log->wake);
+}
+
+uint64_t slog_dropped(const SLOG *log) {
+    return atomic_load_explicit(&((SLOG *)log)->dropped, memory_order_relaxed);
+}
+
+// flushes everything written so far, then stops the writer thread
+void slog_close(SLOG *log) {
+    if(!log)
+        return;
+    atomic_store(&log->stop, true);
+    sem_post(&log->wake);
+    pthread_join(log->thread, NULL);
+    freeLog(log);
+}
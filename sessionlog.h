@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 Zoe Knox <zoe@pixin.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SESSIONLOG_H
+#define SESSIONLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous compressed session logging. slog_write() only copies the
+ * PTY output into a lock-free single-producer ring; a background thread
+ * batches it into blocks, compresses each one with a small LZ77 codec and
+ * appends them to the log with large sequential writes.
+ *
+ * The log is a sequence of blocks, each a SLOGBLOCK header followed by
+ * compLen bytes. Every block decodes on its own with slog_decompress(), or
+ * is stored as-is if SLOG_STORED is set. Every SLOG_INDEX_INTERVAL bytes
+ * of output, a SLOGINDEX entry pointing at the next block is appended to a
+ * companion index file (the log path with ".idx" added) for seeking.
+ */
+#define SLOG_MAGIC          0x31424c54 // "TLB1"
+#define SLOG_BLOCK_SIZE     (64 * 1024)
+#define SLOG_INDEX_INTERVAL (1024 * 1024)
+#define SLOG_STORED         0x01
+
+typedef struct SLOGBLOCK SLOGBLOCK;
+struct SLOGBLOCK {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t rawLen;
+    uint32_t compLen;
+    uint64_t time;      // wall clock, nanoseconds since the epoch
+};
+
+typedef struct SLOGINDEX SLOGINDEX;
+struct SLOGINDEX {
+    uint64_t rawOffset; // bytes of output logged before this block
+    uint64_t fileOffset;
+    uint64_t time;
+};
+
+typedef struct SLOG SLOG;
+
+SLOG *slog_open(const char *path);
+void slog_write(SLOG *log, const char *s, size_t n);
+uint64_t slog_dropped(const SLOG *log);
+void slog_close(SLOG *log);
+
+size_t slog_compress(const char *src, size_t n, char *dst, size_t cap);
+size_t slog_decompress(const char *src, size_t n, char *dst, size_t cap);
+
+#endif
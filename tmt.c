@@ -29,6 +29,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "tmt.h"
 
 #define BUF_MAX 100
@@ -103,6 +106,7 @@ static void
 clearline(TMT *vt, TMTLINE *l, size_t s, size_t e)
 {
     vt->dirty = l->dirty = true;
+    if (e >= vt->screen.ncol) l->wrap = false;
     for (size_t i = s; i < e && i < vt->screen.ncol; i++){
         l->chars[i].a = defattrs;
         l->chars[i].c = L' ';
@@ -420,6 +424,7 @@ writecharatcurs(TMT *vt, wchar_t w)
     if (c->c < s->ncol - 1)
         c->c++;
     else{
+        CLINE(vt)->wrap = true;
         c->c = 0;
         c->r++;
     }
@@ -503,3 +508,241 @@ tmt_reset(TMT *vt)
     CB(vt, TMT_MSG_CURSOR, "t");
     notify(vt, true, true);
 }
+
+/**** TEXT EXPORT */
+struct exportbuf{
+    char *buf;
+    size_t n;   /* capacity of buf, including the terminating NUL */
+    size_t len; /* bytes produced so far, even those that didn't fit */
+    size_t used; /* bytes actually stored in buf */
+};
+
+/* Append s, or as much of it as fits without splitting a UTF-8 sequence.
+ * Once anything has been cut short nothing more is stored, but len keeps
+ * counting so the caller learns how big a buffer it needs.
+ */
+static void
+put(struct exportbuf *b, const char *s, size_t n)
+{
+    if (b->used == b->len && b->len + 1 < b->n){
+        size_t k = MIN(n, b->n - b->len - 1);
+        if (k < n)
+            while (k && ((unsigned char)s[k] & 0xc0) == 0x80)
+                k--;
+        memcpy(b->buf + b->len, s, k);
+        b->used += k;
+    }
+    b->len += n;
+}
+
+static size_t
+utf8char(wchar_t w, char *o)
+{
+    uint32_t c = (uint32_t)w;
+    if (c >= 0xd800 && c <= 0xdfff) c = TMT_INVALID_CHAR;
+    if (c < 0x80){
+        o[0] = (char)c;
+        return 1;
+    } else if (c < 0x800){
+        o[0] = (char)(0xc0 | (c >> 6));
+        o[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    } else if (c < 0x10000){
+        o[0] = (char)(0xe0 | (c >> 12));
+        o[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        o[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    } else if (c < 0x110000){
+        o[0] = (char)(0xf0 | (c >> 18));
+        o[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+        o[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+        o[3] = (char)(0x80 | (c & 0x3f));
+        return 4;
+    }
+    return utf8char(TMT_INVALID_CHAR, o);
+}
+
+/* Encode n UTF-32 characters into o, which must have room for 4n bytes.
+ * Terminal text is overwhelmingly ASCII, so runs of eight ASCII characters
+ * are narrowed with SSE2 where available and only the rest go one by one.
+ */
+static size_t
+utf8encode(const wchar_t *w, size_t n, char *o)
+{
+    size_t i = 0, len = 0;
+
+    #if defined(__SSE2__) && WCHAR_MAX > 0xffff
+    const __m128i hi = _mm_set1_epi32(~0x7f);
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 8 <= n){
+        __m128i a = _mm_loadu_si128((const __m128i *)(w + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(w + i + 4));
+        __m128i t = _mm_and_si128(_mm_or_si128(a, b), hi);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(t, zero)) != 0xffff){
+            /* something in here needs the slow path */
+            for (size_t e = i + 8; i < e; i++)
+                len += utf8char(w[i], o + len);
+            continue;
+        }
+        __m128i p = _mm_packs_epi32(a, b);
+        _mm_storel_epi64((__m128i *)(o + len), _mm_packus_epi16(p, p));
+        i += 8;
+        len += 8;
+    }
+    #endif
+
+    for (; i < n; i++){
+        if ((uint32_t)w[i] < 0x80)
+            o[len++] = (char)w[i];
+        else
+            len += utf8char(w[i], o + len);
+    }
+    return len;
+}
+
+static void
+putwide(struct exportbuf *b, const wchar_t *w, size_t n)
+{
+    if (b->used == b->len && b->len + 4 * n < b->n){ /* encode in place */
+        b->len += utf8encode(w, n, b->buf + b->len);
+        b->used = b->len;
+        return;
+    }
+
+    char tmp[4 * 64];
+    for (size_t i = 0; i < n; i += 64){
+        size_t k = MIN(64, n - i);
+        put(b, tmp, utf8encode(w + i, k, tmp));
+    }
+}
+
+/* anything outside the palette, including an unset 0, is the default */
+#define PALETTE(x) (((x) >= TMT_COLOR_BLACK && (x) < TMT_COLOR_MAX)? (x) \
+                                                          : TMT_COLOR_DEFAULT)
+
+static void
+putsgr(struct exportbuf *b, const TMTATTRS *a)
+{
+    char r[BUF_MAX + 1] = "\033[0";
+    size_t n = 3;
+
+    if (a->bold)      n += snprintf(r + n, BUF_MAX - n, ";1");
+    if (a->dim)       n += snprintf(r + n, BUF_MAX - n, ";2");
+    if (a->underline) n += snprintf(r + n, BUF_MAX - n, ";4");
+    if (a->blink)     n += snprintf(r + n, BUF_MAX - n, ";5");
+    if (a->reverse)   n += snprintf(r + n, BUF_MAX - n, ";7");
+    if (a->invisible) n += snprintf(r + n, BUF_MAX - n, ";8");
+    if (PALETTE(a->fg) != TMT_COLOR_DEFAULT)
+        n += snprintf(r + n, BUF_MAX - n, ";%d", 30 + a->fg - TMT_COLOR_BLACK);
+    if (PALETTE(a->bg) != TMT_COLOR_DEFAULT)
+        n += snprintf(r + n, BUF_MAX - n, ";%d", 40 + a->bg - TMT_COLOR_BLACK);
+    r[n++] = 'm';
+    put(b, r, n);
+}
+
+static bool
+sameattrs(const TMTATTRS *a, const TMTATTRS *b)
+{
+    return a->bold == b->bold && a->dim == b->dim &&
+           a->underline == b->underline && a->blink == b->blink &&
+           a->reverse == b->reverse && a->invisible == b->invisible &&
+           PALETTE(a->fg) == PALETTE(b->fg) && PALETTE(a->bg) == PALETTE(b->bg);
+}
+
+static bool
+blank(const TMTCHAR *c, int flags)
+{
+    if (c->c != L' ') return false;
+    return !(flags & TMT_EXPORT_SGR) ||
+           (!c->a.reverse && !c->a.underline &&
+            PALETTE(c->a.bg) == TMT_COLOR_DEFAULT);
+}
+
+static bool
+blankrow(const TMTLINE *l, size_t s, size_t e, int flags)
+{
+    for (size_t i = s; i < e; i++)
+        if (!blank(&l->chars[i], flags))
+            return false;
+    return true;
+}
+
+/* Export columns [s, e) of line l. */
+static void
+exportrow(struct exportbuf *b, const TMTLINE *l, size_t s, size_t e,
+          int flags, TMTATTRS *last)
+{
+    wchar_t w[e - s + 1];
+    size_t n = 0;
+
+    for (size_t i = s; i < e; i++){
+        if ((flags & TMT_EXPORT_SGR) && !sameattrs(&l->chars[i].a, last)){
+            putwide(b, w, n);
+            n = 0;
+            *last = l->chars[i].a;
+            putsgr(b, last);
+        }
+        w[n++] = l->chars[i].c;
+    }
+    putwide(b, w, n);
+}
+
+size_t
+tmt_export(const TMT *vt, const TMTPOINT *start, const TMTPOINT *end,
+           int flags, char *buf, size_t n)
+{
+    const TMTSCREEN *s = &vt->screen;
+    struct exportbuf b = {buf, n, 0, 0};
+    TMTPOINT p0 = {0, 0}, p1 = {s->nline - 1, s->ncol - 1};
+    TMTATTRS last = defattrs;
+
+    if (start) p0 = *start;
+    if (end) p1 = *end;
+    p0.r = MIN(p0.r, s->nline - 1); p0.c = MIN(p0.c, s->ncol - 1);
+    p1.r = MIN(p1.r, s->nline - 1); p1.c = MIN(p1.c, s->ncol - 1);
+    if (p1.r < p0.r || (p1.r == p0.r && p1.c < p0.c)){
+        TMTPOINT t = p0; p0 = p1; p1 = t;
+    }
+
+    size_t lc = p0.c, rc = p1.c;
+    if ((flags & TMT_EXPORT_RECT) && rc < lc){
+        size_t t = lc; lc = rc; rc = t;
+    }
+
+    /* the empty rest of the screen below a stream isn't worth a run of
+     * newlines; the row before it then ends wherever its text does
+     */
+    if (!(flags & (TMT_EXPORT_RECT | TMT_EXPORT_NOTRIM))){
+        while (p1.r > p0.r && blankrow(s->lines[p1.r], 0, p1.c + 1, flags)){
+            p1.r--;
+            p1.c = s->ncol - 1;
+        }
+    }
+
+    for (size_t r = p0.r; r <= p1.r; r++){
+        const TMTLINE *l = s->lines[r];
+        size_t cs = lc, ce = rc + 1;
+        if (!(flags & TMT_EXPORT_RECT)){
+            cs = r == p0.r? p0.c : 0;
+            ce = r == p1.r? p1.c + 1 : s->ncol;
+        }
+
+        /* a soft-wrapped row runs straight into the next one, so its
+         * trailing blanks are real content and there is no line break
+         */
+        bool joined = !(flags & TMT_EXPORT_RECT) && r < p1.r && l->wrap;
+        if (!joined && !(flags & TMT_EXPORT_NOTRIM))
+            while (ce > cs && blank(&l->chars[ce - 1], flags))
+                ce--;
+
+        exportrow(&b, l, cs, ce, flags, &last);
+        if (r < p1.r && !joined)
+            put(&b, "\n", 1);
+    }
+
+    if (!sameattrs(&last, &defattrs))
+        put(&b, "\033[0m", 4);
+    if (n)
+        buf[b.used] = 0;
+    return b.len;
+}
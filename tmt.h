@@ -106,6 +106,7 @@ struct TMTPOINT{
 typedef struct TMTLINE TMTLINE;
 struct TMTLINE{
     bool dirty;
+    bool wrap;
     TMTCHAR chars[];
 };
 
@@ -128,6 +129,11 @@ typedef enum{
 
 typedef void (*TMTCALLBACK)(tmt_msg_t m, struct TMT *v, const void *r, void *p);
 
+/**** TEXT EXPORT */
+#define TMT_EXPORT_RECT   0x01 /* same columns from each row, not a stream */
+#define TMT_EXPORT_SGR    0x02 /* annotate rendition with SGR sequences    */
+#define TMT_EXPORT_NOTRIM 0x04 /* keep trailing blanks on each row         */
+
 /**** PUBLIC FUNCTIONS */
 TMT *tmt_open(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
               const wchar_t *acs);
@@ -138,5 +144,7 @@ const TMTSCREEN *tmt_screen(const TMT *vt);
 const TMTPOINT *tmt_cursor(const TMT *vt);
 void tmt_clean(TMT *vt);
 void tmt_reset(TMT *vt);
+size_t tmt_export(const TMT *vt, const TMTPOINT *start, const TMTPOINT *end,
+                  int flags, char *buf, size_t n);
 
 #endif